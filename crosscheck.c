@@ -0,0 +1,508 @@
+// crosscheck.c --- differential test of the rich_header.h scanners
+//
+// Copyright (C) 2024 Ryan Thoris <rythoris@proton.me>
+//
+// crosscheck.c is free software; you can redistribute it and/or modify it under
+// the terms of the GNU General Public License (version 3) as published by the
+// Free Software Foundation.
+//
+// Generates random buffers (planted, damaged and truncated rich headers, fake
+// "Rich" and "DanS" dwords, every alignment and sizes around the block and
+// stride boundaries) and compares every scanner of the library against a
+// naive reference written from the format alone, which shares no code with
+// the library. The first divergence is printed along with the seed.
+//
+//     cc -std=c99 -O2 -o crosscheck crosscheck.c && ./crosscheck [buffers] [seed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define RICH_HEADER_IMPLEMENTATION
+#define RICH_HEADER_CROSSCHECK
+#include "rich_header.h"
+
+#define RICH 0x68636952u // "Rich"
+#define DANS 0x536e6144u // "DanS"
+
+// Largest generated buffer, big enough for several batch strides and blocks.
+#define BUFFER_MAX 1280
+
+static uint64_t rng_state;
+
+static uint32_t
+rng(void)
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return (uint32_t)(rng_state >> 32);
+}
+
+static uint32_t
+load32(const unsigned char *p)
+{
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void
+store32(unsigned char *p, uint32_t value)
+{
+  p[0] = (unsigned char)value;
+  p[1] = (unsigned char)(value >> 8);
+  p[2] = (unsigned char)(value >> 16);
+  p[3] = (unsigned char)(value >> 24);
+}
+
+static uint32_t
+rol(uint32_t value, uint32_t shift)
+{
+  shift &= 31;
+  return shift ? (value << shift) | (value >> (32 - shift)) : value;
+}
+
+// Checksum of the bytes before the header, e_lfanew excluded.
+static uint32_t
+reference_stub_checksum(const unsigned char *data, size_t dans)
+{
+  uint32_t checksum = (uint32_t)dans;
+  for (size_t i = 0; i < dans; ++i)
+    if (i < 0x3c || i >= 0x40) checksum += rol(data[i], (uint32_t)i);
+  return checksum;
+}
+
+static uint32_t
+reference_checksum(const unsigned char *data, size_t dans, size_t products_len, uint32_t key)
+{
+  uint32_t checksum = reference_stub_checksum(data, dans);
+  for (size_t i = 0; i < products_len; ++i) {
+    const unsigned char *product = data + dans + 16 + i * 8;
+    checksum += rol(load32(product) ^ key, load32(product + 4) ^ key);
+  }
+  return checksum;
+}
+
+static bool
+reference_is_head(const unsigned char *data, size_t offset, uint32_t key)
+{
+  return (load32(data + offset) ^ key) == DANS && load32(data + offset + 4) == key &&
+         load32(data + offset + 8) == key && load32(data + offset + 12) == key;
+}
+
+// Look at every step bytes from start for "Rich", then for the nearest head
+// before it (one product at a time) that comes after the previous candidate.
+static long
+reference_find(const unsigned char *data, size_t size, size_t start, size_t step, size_t *rich)
+{
+  long status = RICH_HEADER_NOT_FOUND;
+  size_t lower = start;
+
+  for (size_t r = start; r + 8 <= size; r += step) {
+    if (load32(data + r) != RICH) continue;
+
+    uint32_t key = load32(data + r + 4);
+    *rich = r;
+    status = RICH_HEADER_DANS_NOT_FOUND;
+    for (size_t head = 16; head <= r - lower; head += 8)
+      if (reference_is_head(data, r - head, key)) return (long)head;
+    lower = r + step;
+  }
+  return status;
+}
+
+// Recovery: the first X,K,K,K head, ended by the first slot followed by the Key
+// whose products checksum to the Key.
+static long
+reference_recover(const unsigned char *data, size_t size, size_t *rich)
+{
+  for (size_t head = 64; head + 16 + 8 <= size; head += 4) {
+    uint32_t key = load32(data + head + 4);
+    if (!reference_is_head(data, head, key)) continue;
+
+    for (size_t end = head + 16; end + 8 <= size; end += 8) {
+      if (load32(data + end + 4) == key && reference_checksum(data, head, (end - head - 16) / 8, key) == key) {
+        *rich = end;
+        return (long)(end - head);
+      }
+    }
+    return RICH_HEADER_NOT_FOUND;
+  }
+  return RICH_HEADER_NOT_FOUND;
+}
+
+static bool
+reference_is_pe(const unsigned char *data, size_t size)
+{
+  if (size < 64 || data[0] != 'M' || data[1] != 'Z') return false;
+  uint32_t e_lfanew = load32(data + 0x3c);
+  return e_lfanew >= 64 && e_lfanew <= RICH_HEADER_MAX_LFANEW && size >= (size_t)e_lfanew + 4 &&
+         memcmp(data + e_lfanew, "PE\0\0", 4) == 0;
+}
+
+// What rich_header_scan_ex is expected to return without a budget.
+static RICH_HEADER_RESULT
+reference_scan(const unsigned char *data, size_t size, unsigned options)
+{
+  RICH_HEADER_RESULT result;
+  bool unaligned = options & RICH_HEADER_SCAN_UNALIGNED;
+  size_t rich = 0;
+  long found = reference_find(data, size, unaligned ? 0 : 64, unaligned ? 1 : 4, &rich);
+
+  memset(&result, 0, sizeof(result));
+  if ((found == RICH_HEADER_NOT_FOUND || found == RICH_HEADER_DANS_NOT_FOUND) && !unaligned &&
+      !(options & RICH_HEADER_SCAN_NO_RECOVER)) {
+    // the status of the scan stays if the recovery fails too.
+    size_t recovered_rich = 0;
+    long recovered = reference_recover(data, size, &recovered_rich);
+    if (recovered > 0) {
+      found = recovered;
+      rich = recovered_rich;
+      result.Flags |= RICH_HEADER_FLAG_RECOVERED;
+    }
+  }
+  if (found <= 0) {
+    result.Status = (int32_t)found;
+    return result;
+  }
+
+  result.RichOffset = (uint32_t)rich;
+  result.DansOffset = (uint32_t)(rich - (size_t)found);
+  result.ProductsLen = (uint32_t)(found - 16) / 8;
+  result.Key = load32(data + rich + 4);
+  if (unaligned || (options & RICH_HEADER_SCAN_NO_FLAGS)) return result;
+
+  if (reference_is_pe(data, size)) result.Flags |= RICH_HEADER_FLAG_PE;
+  if (reference_checksum(data, result.DansOffset, result.ProductsLen, result.Key) == result.Key)
+    result.Flags |= RICH_HEADER_FLAG_CHECKSUM;
+  return result;
+}
+
+static unsigned long long seed;
+static size_t buffer_index;
+
+static void
+print_result(const char *name, const RICH_HEADER_RESULT *result)
+{
+  fprintf(stderr, "  %-9s status %d flags %u dans %u rich %u products %u key 0x%08x\n", name, result->Status,
+          result->Flags, result->DansOffset, result->RichOffset, result->ProductsLen, result->Key);
+}
+
+static void
+fail(const char *what, const unsigned char *data, size_t size)
+{
+  fprintf(stderr, "crosscheck: %s diverged on buffer %zu (seed %llu, size %zu, address %% 8 = %u)\n", what,
+          buffer_index, seed, size, (unsigned)((uintptr_t)data & 7));
+  exit(1);
+}
+
+static void
+check_result(const char *what, const unsigned char *data, size_t size, const RICH_HEADER_RESULT *result,
+             const RICH_HEADER_RESULT *expected)
+{
+  if (memcmp(result, expected, sizeof(*result)) == 0) return;
+  print_result("got", result);
+  print_result("expected", expected);
+  fail(what, data, size);
+}
+
+// Unmask the header of result with rich_header_unmask on an aligned copy, the
+// products start at unmasked + 4.
+static void
+reference_unmask(const unsigned char *data, size_t size, const RICH_HEADER_RESULT *result, uint32_t *unmasked)
+{
+  static uint32_t copy[BUFFER_MAX / 4 + 2];
+  size_t header_size = result->RichOffset - result->DansOffset;
+
+  memcpy(copy, data + result->DansOffset, header_size + sizeof(IMAGE_RICH_HEADER));
+  rich_header_unmask((const IMAGE_RICH_HEADER*)((char*)copy + header_size), header_size, (char*)unmasked);
+  if (unmasked[0] != DANS || unmasked[1] != 0 || unmasked[2] != 0 || unmasked[3] != 0)
+    fail("rich_header_unmask (head)", data, size);
+}
+
+static void
+check_products(const char *what, const unsigned char *data, size_t size, const RICH_HEADER_RESULT *result,
+               const RICH_HEADER_DECODED *decoded)
+{
+  static uint32_t unmasked[BUFFER_MAX / 4 + 2];
+
+  reference_unmask(data, size, result, unmasked);
+  if ((uintptr_t)decoded->Spill & 7) fail("rich_header_arena_alloc (alignment)", data, size);
+  if (decoded->ProductsLen != result->ProductsLen ||
+      memcmp(rich_header_decoded_products(decoded), unmasked + 4, decoded->ProductsLen * 8) != 0)
+    fail(what, data, size);
+}
+
+// rich_header_decode (through an unaligned arena so the products spill) must
+// give the same products as rich_header_unmask.
+static void
+check_decode(const unsigned char *data, size_t size, const RICH_HEADER_RESULT *result)
+{
+  static char arena_buffer[BUFFER_MAX + 1];
+  RICH_HEADER_ARENA arena = { arena_buffer + 1, sizeof(arena_buffer) - 1, 0, NULL, NULL };
+  RICH_HEADER_DECODED decoded;
+
+  if (rich_header_decode(data, result, &decoded, &arena) != RICH_HEADER_OK) fail("rich_header_decode", data, size);
+  check_products("rich_header_decode against rich_header_unmask", data, size, result, &decoded);
+}
+
+// Upstream allocator of the batch arena, a pool which fails once it's empty.
+typedef struct {
+  char *base;
+  size_t size;
+  size_t used;
+  size_t calls;
+  size_t misaligned; // calls which didn't ask for 8 bytes alignment
+} upstream_pool;
+
+static void *
+upstream_alloc(void *ctx, size_t size, size_t alignment)
+{
+  upstream_pool *pool = (upstream_pool*)ctx;
+  size_t offset = (pool->used + alignment - 1) & ~(alignment - 1);
+
+  pool->calls += 1;
+  if (alignment != 8) pool->misaligned += 1;
+  if (offset > pool->size || pool->size - offset < size) return NULL;
+  pool->used = offset + size;
+  return pool->base + offset;
+}
+
+static size_t upstream_calls;
+
+// rich_header_decode_batch with a small arena (sometimes none) backed by a
+// small pool: every header is decoded like rich_header_unmask does, or left
+// empty if neither had room, in which case RICH_HEADER_NO_MEMORY is returned.
+static void
+check_decode_batch(size_t n, const void *const data[], const size_t data_size[], const RICH_HEADER_RESULT result[])
+{
+  static char arena_buffer[BUFFER_MAX + 1];
+  static uint64_t pool_buffer[BUFFER_MAX / 8];
+  RICH_HEADER_DECODED decoded[RICH_HEADER_BATCH_LANES * 3];
+  upstream_pool pool = { (char*)pool_buffer, rng() % sizeof(pool_buffer), 0, 0, 0 };
+  RICH_HEADER_ARENA arena = { arena_buffer + rng() % 8, rng() % (BUFFER_MAX / 2), 0, NULL, NULL };
+  RICH_HEADER_ARENA *batch_arena = rng() % 8 ? &arena : NULL;
+  bool failed = false;
+
+  if (rng() % 4) {
+    arena.Upstream = upstream_alloc;
+    arena.UpstreamCtx = &pool;
+  }
+
+  int status = rich_header_decode_batch(n, data, result, decoded, batch_arena);
+  for (size_t i = 0; i < n; ++i) {
+    const unsigned char *bytes = (const unsigned char*)data[i];
+    if (result[i].Status != RICH_HEADER_OK || (decoded[i].ProductsLen == 0 && result[i].ProductsLen > 0)) {
+      if (decoded[i].ProductsLen != 0 || decoded[i].Spill != NULL)
+        fail("rich_header_decode_batch (empty)", bytes, data_size[i]);
+      failed |= result[i].Status == RICH_HEADER_OK;
+    } else {
+      check_products("rich_header_decode_batch against rich_header_unmask", bytes, data_size[i], &result[i],
+                     &decoded[i]);
+    }
+  }
+  const unsigned char *first = (const unsigned char*)data[0];
+  if (status != (failed ? RICH_HEADER_NO_MEMORY : RICH_HEADER_OK))
+    fail("rich_header_decode_batch (status)", first, data_size[0]);
+  if (pool.misaligned > 0) fail("rich_header_arena_alloc (upstream alignment)", first, data_size[0]);
+  if (failed && batch_arena != NULL && arena.Upstream != NULL && pool.calls == 0)
+    fail("rich_header_arena_alloc (upstream not called)", first, data_size[0]);
+  upstream_calls += pool.calls;
+}
+
+// Plant a valid header (with a correct checksum, and zero object counts now
+// and then) at a dword aligned offset, returns its offset or 0 if it doesn't
+// fit. The number of products is written to *products_len.
+static size_t
+plant_header(unsigned char *data, size_t size, size_t *products_len)
+{
+  size_t len = rng() % 40;
+  size_t total = 16 + len * 8 + 8;
+  if (size < 64 + total) return 0;
+
+  size_t dans = 64 + (rng() % ((size - 64 - total) / 4 + 1)) * 4;
+  uint32_t products[40][2];
+  uint32_t key = reference_stub_checksum(data, dans);
+  for (size_t i = 0; i < len; ++i) {
+    products[i][0] = rng() % 4 ? (rng() % 0x110) << 16 | (rng() & 0xffff) : rng();
+    products[i][1] = rng() % 4 ? rng() % 300 : 0;
+    key += rol(products[i][0], products[i][1]);
+  }
+
+  store32(data + dans, DANS ^ key);
+  for (size_t i = 1; i < 4; ++i) store32(data + dans + i * 4, key);
+  for (size_t i = 0; i < len; ++i) {
+    store32(data + dans + 16 + i * 8, products[i][0] ^ key);
+    store32(data + dans + 20 + i * 8, products[i][1] ^ key);
+  }
+  store32(data + dans + 16 + len * 8, RICH);
+  store32(data + dans + 20 + len * 8, key);
+
+  *products_len = len;
+  return dans;
+}
+
+// Sizes around the MS-DOS header, the 64 byte blocks of the signature scan and
+// the batch stride, plus a few arbitrary ones.
+static size_t
+random_size(void)
+{
+  switch (rng() % 4) {
+  case 0: return rng() % 96;
+  case 1: return (rng() % (BUFFER_MAX / 64 - 1) + 1) * 64 - 8 + rng() % 16;
+  case 2: return (rng() % (BUFFER_MAX / RICH_HEADER_BATCH_STRIDE)) * RICH_HEADER_BATCH_STRIDE + rng() % 9;
+  default: return rng() % BUFFER_MAX;
+  }
+}
+
+// Fill a buffer of random size, returns the size. *dans and *products_len
+// describe the planted header if there's one, *damaged tells if its "Rich"
+// signature was overwritten (so it has to be recovered).
+static size_t
+generate(unsigned char *data, size_t *dans, size_t *products_len, bool *damaged)
+{
+  size_t size = random_size();
+  uint32_t key = rng();
+  uint32_t alphabet[] = { RICH, key, DANS ^ key, 0, rng() };
+  unsigned mode = rng() % 4;
+
+  for (size_t i = 0; i < size; ++i) data[i] = (unsigned char)rng();
+  if (mode == 1 || mode == 2) {
+    // a few tokens of a rich header at dword (or any) offsets
+    size_t tokens = mode == 1 ? size / 4 : rng() % 8;
+    for (size_t i = 0; i < tokens && size >= 4; ++i) {
+      size_t offset = rng() % (size - 3);
+      if (rng() % 4) offset &= ~(size_t)3;
+      store32(data + offset, alphabet[rng() % 5]);
+    }
+  }
+  if (size >= 64 && rng() % 2) {
+    data[0] = 'M';
+    data[1] = 'Z';
+    uint32_t e_lfanew = 64 + (rng() % ((size - 64) / 4 + 1)) * 4;
+    store32(data + 0x3c, e_lfanew);
+    if (e_lfanew + 4 <= size && rng() % 2) memcpy(data + e_lfanew, "PE\0\0", 4);
+  }
+
+  *dans = 0;
+  *damaged = false;
+  if (mode != 1 && rng() % 3) {
+    *dans = plant_header(data, size, products_len);
+    if (*dans != 0 && rng() % 3 == 0) {
+      store32(data + *dans + 16 + *products_len * 8, rng());
+      *damaged = true;
+
+      // a stray "Rich" after it (before it would change the checksum) is
+      // rejected and must not prevent the recovery.
+      size_t end = *dans + 16 + *products_len * 8 + 8;
+      if (end + 4 <= size && rng() % 2) store32(data + end + (rng() % ((size - end) / 4)) * 4, RICH);
+    }
+    if (*dans != 0 && rng() % 8 == 0) {
+      // truncated somewhere in the header
+      size = *dans + rng() % (16 + *products_len * 8 + 8);
+      *dans = 0;
+    }
+  }
+  return size;
+}
+
+int
+main(int argc, char **argv)
+{
+  static unsigned char storage[RICH_HEADER_BATCH_LANES * 3][BUFFER_MAX + 8];
+  size_t buffers = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+  seed = argc > 2 ? strtoull(argv[2], NULL, 10) : 1;
+  rng_state = seed * 0x9e3779b97f4a7c15ull + 1;
+
+  size_t recovered = 0, found = 0;
+  for (buffer_index = 0; buffer_index < buffers;) {
+    const void *batch_data[RICH_HEADER_BATCH_LANES * 3];
+    size_t batch_size[RICH_HEADER_BATCH_LANES * 3];
+    RICH_HEADER_RESULT batch_result[RICH_HEADER_BATCH_LANES * 3], expected[RICH_HEADER_BATCH_LANES * 3];
+    size_t n = 1 + rng() % (RICH_HEADER_BATCH_LANES * 3);
+    size_t max_scan = rng() % 2 ? SIZE_MAX : rng() % (2 * BUFFER_MAX);
+
+    for (size_t i = 0; i < n; ++i, ++buffer_index) {
+      unsigned char *data = storage[i] + rng() % 8;
+      size_t dans, products_len = 0;
+      bool damaged;
+      size_t size = generate(data, &dans, &products_len, &damaged);
+      RICH_HEADER_RESULT result, reference = reference_scan(data, size, RICH_HEADER_SCAN_OPTIONS);
+
+      batch_data[i] = data;
+      batch_size[i] = size;
+      expected[i] = reference;
+
+      // rich_header_from_data is the scan without recovery and flags.
+      IMAGE_RICH_HEADER *rhdr = NULL;
+      size_t rich = 0;
+      long size_found = rich_header_from_data(data, size, &rhdr);
+      long size_expected = reference_find(data, size, 64, 4, &rich);
+      if (size_found != size_expected ||
+          (size_found != RICH_HEADER_NOT_FOUND && (const unsigned char*)rhdr != data + rich))
+        fail("rich_header_from_data", data, size);
+
+      // so is rich_header_from_data_bounded, and the forward scan plus the
+      // backward walks are linear too.
+      size_found = rich_header_from_data_bounded(data, size, rng() % (2 * size + 64), &rhdr);
+      if (size_found != RICH_HEADER_BUDGET_EXCEEDED && (size_found != size_expected ||
+          (size_found != RICH_HEADER_NOT_FOUND && (const unsigned char*)rhdr != data + rich)))
+        fail("rich_header_from_data_bounded (budget)", data, size);
+      if (rich_header_from_data_bounded(data, size, 2 * size + 64, &rhdr) != size_expected)
+        fail("rich_header_from_data_bounded (linear budget)", data, size);
+
+      rich_header_scan(data, size, SIZE_MAX, &result);
+      check_result("rich_header_scan", data, size, &result, &reference);
+
+      RICH_HEADER_RESULT unaligned = reference_scan(data, size, RICH_HEADER_SCAN_UNALIGNED);
+      rich_header_scan_ex(data, size, SIZE_MAX, RICH_HEADER_SCAN_UNALIGNED, &result);
+      check_result("rich_header_scan_ex (unaligned)", data, size, &result, &unaligned);
+
+      // a budget either stops the scan or doesn't change its result, and the
+      // whole scan (recovery included) is linear in the size of the data.
+      size_t budget = rng() % (5 * size + 64);
+      rich_header_scan(data, size, budget, &result);
+      if (result.Status != RICH_HEADER_BUDGET_EXCEEDED)
+        check_result("rich_header_scan (budget)", data, size, &result, &reference);
+      rich_header_scan(data, size, 5 * size + 64, &result);
+      check_result("rich_header_scan (linear budget)", data, size, &result, &reference);
+
+      if (reference.Status == RICH_HEADER_OK) {
+        found += 1;
+        check_decode(data, size, &reference);
+      }
+
+      // a planted header is found where it was planted, damaged or not, unless
+      // the random data before it already holds a header (or a "Rich").
+      if (dans != 0 && reference.Status == RICH_HEADER_OK && reference.DansOffset >= dans) {
+        if (reference.DansOffset != dans || reference.ProductsLen != products_len ||
+            (!(RICH_HEADER_SCAN_OPTIONS & (RICH_HEADER_SCAN_NO_FLAGS | RICH_HEADER_SCAN_UNALIGNED)) &&
+             !(reference.Flags & RICH_HEADER_FLAG_CHECKSUM)) ||
+            damaged != !!(reference.Flags & RICH_HEADER_FLAG_RECOVERED))
+          fail("planted header", data, size);
+        recovered += damaged;
+      }
+
+      // rich_header_recover by itself, whatever the scan options are.
+      size_found = rich_header_recover(data, size, &rhdr);
+      size_expected = reference_recover(data, size, &rich);
+      if (size_found != size_expected || (size_found > 0 && (const unsigned char*)rhdr != data + rich))
+        fail("rich_header_recover", data, size);
+    }
+
+    rich_header_scan_batch(n, batch_data, batch_size, SIZE_MAX, batch_result);
+    for (size_t i = 0; i < n; ++i)
+      check_result("rich_header_scan_batch", batch_data[i], batch_size[i], &batch_result[i], &expected[i]);
+    check_decode_batch(n, batch_data, batch_size, batch_result);
+
+    rich_header_scan_batch(n, batch_data, batch_size, max_scan, batch_result);
+    for (size_t i = 0; i < n; ++i) {
+      RICH_HEADER_RESULT single;
+      rich_header_scan(batch_data[i], batch_size[i], max_scan, &single);
+      check_result("rich_header_scan_batch (budget)", batch_data[i], batch_size[i], &batch_result[i], &single);
+    }
+  }
+
+  printf("crosscheck: %zu buffers ok (%zu headers, %zu recovered, %zu upstream allocations), seed %llu\n",
+         buffer_index, found, recovered, upstream_calls, seed);
+  return 0;
+}
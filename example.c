@@ -6,60 +6,257 @@
 // the terms of the GNU General Public License (version 3) as published by the
 // Free Software Foundation.
 
-#include <assert.h>
+#define _POSIX_C_SOURCE 199309L // clock_gettime
+
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/stat.h>
+#include <string.h>
+#include <time.h>
+
+static double
+now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Chrome trace events (chrome://tracing or Perfetto) of every stage are
+// written to the file named by the RICH_HEADER_TRACE environment variable.
+// When it's not set tracing costs a single branch.
+static FILE *trace_file;
+static const char *trace_separator = "";
+
+static void
+trace_event(const char *name, char phase)
+{
+  fprintf(trace_file, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":1}",
+          trace_separator, name, phase, now() * 1e6);
+  trace_separator = ",\n";
+}
+
+#define RICH_HEADER_TRACE_BEGIN(name) do { if (trace_file != NULL) trace_event((name), 'B'); } while (0)
+#define RICH_HEADER_TRACE_END(name) do { if (trace_file != NULL) trace_event((name), 'E'); } while (0)
 
 #define RICH_HEADER_IMPLEMENTATION
 #include "rich_header.h"
 
-int
-main(int argc, char **argv)
+// Number of the slowest files reported for each phase.
+#define SLOWEST_FILES_LEN 10
+
+typedef struct {
+  const char *path;
+  size_t size;
+  double seconds;
+} slow_file;
+
+// Bounded min-heap of the slowest files of a phase, the fastest of them is at
+// the top so it's the one replaced by a slower file.
+typedef struct {
+  const char *phase;
+  size_t len;
+  slow_file files[SLOWEST_FILES_LEN];
+} slowest_files;
+
+static void
+slowest_files_add(slowest_files *slowest, const char *path, size_t size, double seconds)
 {
-  if (argc != 2) {
-    printf("Usage: %s <PE_FILE>\n", argv[0]);
-    return EXIT_FAILURE;
+  slow_file file = { path, size, seconds };
+  size_t i;
+
+  if (slowest->len < SLOWEST_FILES_LEN) {
+    // sift up the new file from the bottom of the heap.
+    for (i = slowest->len++; i > 0 && slowest->files[(i - 1) / 2].seconds > seconds; i = (i - 1) / 2)
+      slowest->files[i] = slowest->files[(i - 1) / 2];
+  } else if (seconds > slowest->files[0].seconds) {
+    // replace the top and sift it down.
+    for (i = 0; 2 * i + 1 < slowest->len;) {
+      size_t child = 2 * i + 1;
+      if (child + 1 < slowest->len && slowest->files[child + 1].seconds < slowest->files[child].seconds)
+        child += 1;
+      if (slowest->files[child].seconds >= seconds) break;
+      slowest->files[i] = slowest->files[child];
+      i = child;
+    }
+  } else {
+    return;
+  }
+  slowest->files[i] = file;
+}
+
+static int
+slow_file_compare(const void *a, const void *b)
+{
+  double diff = ((const slow_file*)b)->seconds - ((const slow_file*)a)->seconds;
+  return (diff > 0) - (diff < 0);
+}
+
+static void
+slowest_files_print(slowest_files *slowest)
+{
+  qsort(slowest->files, slowest->len, sizeof(slow_file), slow_file_compare);
+  fprintf(stderr, "slowest files (%s):\n", slowest->phase);
+  for (size_t i = 0; i < slowest->len; ++i) {
+    fprintf(stderr, "  %10.6fs %10zu bytes %s\n",
+            slowest->files[i].seconds, slowest->files[i].size, slowest->files[i].path);
   }
+}
 
-  char *file_path = argv[1];
+static size_t
+read_stdio(void *ctx, void *buf, size_t size)
+{
+  return fread(buf, sizeof(char), size, ctx);
+}
 
-  FILE *f = fopen(file_path, "rb");
-  assert(f != NULL);
+// Read the part of the file that may contain the rich header (see
+// rich_header_read_window), returns NULL on failure.
+//
+// There's no need to stat() the file since the MS-DOS header tells us how much
+// we have to read. Files that are not PE files are rejected right after the
+// first 64 byte read, the reason is stored in pe_status.
+//
+// The file is never seeked, so "-" reads from the standard input (e.g. a pipe)
+// and the reading stops right after the window.
+static char *
+read_file(const char *file_path, size_t *file_size, int *pe_status)
+{
+  FILE *f = strcmp(file_path, "-") == 0 ? stdin : fopen(file_path, "rb");
+  if (f == NULL) return NULL;
 
-  struct stat st;
-  assert(!stat(file_path, &st));
-  size_t file_size = st.st_size;
+  char *content = malloc(RICH_HEADER_DOS_HEADER_SIZE);
+  if (content == NULL) {
+    if (f != stdin) fclose(f);
+    return NULL;
+  }
 
-  char *content = malloc(file_size);
-  assert(content != NULL);
+  *file_size = 0;
+  *pe_status = rich_header_read_window(read_stdio, f, content, RICH_HEADER_DOS_HEADER_SIZE, file_size);
 
-  unsigned long n = fread(content, sizeof(char), file_size, f);
-  assert(n > 0);
+  // the first read only covers the MS-DOS header, grow the buffer to the
+  // window and carry on from there.
+  size_t window_size = rich_header_window_size(content, *file_size);
+  if (*pe_status == RICH_HEADER_PE_TRUNCATED && window_size > *file_size) {
+    char *window = realloc(content, window_size);
+    if (window == NULL) {
+      free(content);
+      if (f != stdin) fclose(f);
+      return NULL;
+    }
+    content = window;
+    *pe_status = rich_header_read_window(read_stdio, f, content, window_size, file_size);
+  }
 
-  // check MS-DOS header magic number: "MZ"
-  assert(*((uint16_t*)content) == (uint16_t)0x5a4d);
+  if (f != stdin) fclose(f);
+  return content;
+}
 
-  IMAGE_RICH_HEADER *rich_header;
-  long rich_header_size = rich_header_from_data(content, file_size, &rich_header);
-  assert(rich_header_size > 0);
+// Find and decipher the rich header in place, returns the masked rich header
+// or NULL if it's not found (see result->Status).
+static IMAGE_MASKED_RICH_HEADER *
+parse_rich_header(char *content, size_t file_size, RICH_HEADER_RESULT *result)
+{
+  // the header is recovered even if the "Rich" signature is overwritten, see
+  // RICH_HEADER_FLAG_RECOVERED.
+  if (rich_header_scan(content, file_size, SIZE_MAX, result) != RICH_HEADER_OK) return NULL;
 
-  // Since we want to decipher and overwrite the header in place we calculate
-  // the pointer ourselves (instead of allocating memory).
+  // Since we want to decipher and overwrite the header in place we use the
+  // offsets of the header in the file content (instead of allocating memory).
   //
   //read the 'rich_header_unmask' function comment for more information.
-  IMAGE_MASKED_RICH_HEADER *masked_rich_header = (IMAGE_MASKED_RICH_HEADER*)((char*)rich_header - rich_header_size);
+  IMAGE_RICH_HEADER *rich_header = (IMAGE_RICH_HEADER*)(content + result->RichOffset);
+  IMAGE_MASKED_RICH_HEADER *masked_rich_header = (IMAGE_MASKED_RICH_HEADER*)(content + result->DansOffset);
 
-  rich_header_unmask(rich_header, rich_header_size, (char*)masked_rich_header);
+  rich_header_unmask(rich_header, result->RichOffset - result->DansOffset, (char*)masked_rich_header);
+  return masked_rich_header;
+}
 
-  for (size_t i = 0; i < rich_header_products_len(rich_header_size); ++i) {
+static void
+print_rich_header(const IMAGE_MASKED_RICH_HEADER *masked_rich_header, const RICH_HEADER_RESULT *result)
+{
+  for (size_t i = 0; i < result->ProductsLen; ++i) {
     IMAGE_MASKED_RICH_HEADER_PRODUCT product = masked_rich_header->Products[i];
 
     printf("%-3zu buildNo: 0x%08x objCount: %-5d product_id(%03d): %-30s %s\n",
-           i, product.BuildNumber, product.ProductID, product.ObjectCount,
+           i, product.BuildNumber, product.ObjectCount, product.ProductID,
            rich_header_productid_to_vsver_cstr(product.ProductID),
            rich_header_productid_to_cstr(product.ProductID));
   }
+}
+
+int
+main(int argc, char **argv)
+{
+  if (argc < 2) {
+    printf("Usage: %s <PE_FILE|->...\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int status = EXIT_SUCCESS;
+
+  const char *trace_path = getenv("RICH_HEADER_TRACE");
+  if (trace_path != NULL) {
+    trace_file = fopen(trace_path, "w");
+    if (trace_file != NULL) fputs("[\n", trace_file);
+  }
+  unsigned long rejected[RICH_HEADER_PE_STATUS_COUNT] = { 0 };
+  slowest_files slowest_read = { .phase = "read" }, slowest_parse = { .phase = "parse" };
+
+  for (int i = 1; i < argc; ++i) {
+    char *file_path = argv[i];
+
+    size_t file_size;
+    int pe_status;
+    double start = now();
+    RICH_HEADER_TRACE_BEGIN("open");
+    char *content = read_file(file_path, &file_size, &pe_status);
+    RICH_HEADER_TRACE_END("open");
+    if (content == NULL) {
+      fprintf(stderr, "%s: could not read the file\n", file_path);
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    slowest_files_add(&slowest_read, file_path, file_size, now() - start);
+
+    if (pe_status != RICH_HEADER_PE_OK) {
+      fprintf(stderr, "%s: not a PE file (%s)\n", file_path, rich_header_pe_status_to_cstr(pe_status));
+      rejected[pe_status] += 1;
+      status = EXIT_FAILURE;
+      free(content);
+      continue;
+    }
+
+    RICH_HEADER_RESULT result;
+    start = now();
+    IMAGE_MASKED_RICH_HEADER *masked_rich_header = parse_rich_header(content, file_size, &result);
+    slowest_files_add(&slowest_parse, file_path, file_size, now() - start);
+    if (masked_rich_header == NULL) {
+      fprintf(stderr, "%s: %s\n", file_path, rich_header_status_to_cstr(result.Status));
+      status = EXIT_FAILURE;
+    } else {
+      RICH_HEADER_TRACE_BEGIN("write");
+      if (argc > 2) printf("%s:\n", file_path);
+      print_rich_header(masked_rich_header, &result);
+      RICH_HEADER_TRACE_END("write");
+    }
+
+    free(content);
+  }
+
+  for (int i = 0; i < RICH_HEADER_PE_STATUS_COUNT; ++i) {
+    if (rejected[i] > 0)
+      fprintf(stderr, "rejected (%s): %lu\n", rich_header_pe_status_to_cstr(i), rejected[i]);
+  }
+
+  if (argc > 2) {
+    slowest_files_print(&slowest_read);
+    slowest_files_print(&slowest_parse);
+  }
+
+  if (trace_file != NULL) {
+    fputs("\n]\n", trace_file);
+    fclose(trace_file);
+  }
 
-  return EXIT_SUCCESS;
+  return status;
 }
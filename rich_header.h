@@ -16,20 +16,89 @@
 #define _RICH_HEADER_H
 
 #include <stdbool.h>
+#include <stddef.h> // offsetof
 #include <stdint.h>
-#include <string.h> // memcmp
+#include <string.h> // memcmp, memcpy
 
 // This macro calculates the length of the products in the rich header based on
 // the rich header size.
 #define rich_header_products_len(rich_header_size) \
     (((rich_header_size) - (sizeof(uint32_t)*4)) / sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT))
 
+// Size of an array parameter, C++ has no variably modified parameters so it's
+// left out there.
+#ifdef __cplusplus
+#define RICH_HEADER_VLA(size)
+#else
+#define RICH_HEADER_VLA(size) size
+#endif
+
+// Size of the MS-DOS header (IMAGE_DOS_HEADER) and the offset of its e_lfanew
+// field which points to the PE header.
+#define RICH_HEADER_DOS_HEADER_SIZE 64
+#define RICH_HEADER_LFANEW_OFFSET 0x3c
+
+// Largest e_lfanew accepted by rich_header_check_pe, the default is the same
+// limit that the Windows loader uses (256MiB).
+#ifndef RICH_HEADER_MAX_LFANEW
+#define RICH_HEADER_MAX_LFANEW 0x10000000
+#endif
+
+// Number of buffers scanned together by rich_header_scan_batch and how
+// many bytes of each buffer are scanned before moving on to the next one.
+#ifndef RICH_HEADER_BATCH_LANES
+#define RICH_HEADER_BATCH_LANES 4
+#endif
+#ifndef RICH_HEADER_BATCH_STRIDE
+#define RICH_HEADER_BATCH_STRIDE 64
+#endif
+
+// Software prefetch issued ahead of the scan cursor, the distance is in bytes.
+// Define RICH_HEADER_PREFETCH_DISTANCE to 0 to disable it.
+#ifndef RICH_HEADER_PREFETCH
+#if defined(__GNUC__) || defined(__clang__)
+#define RICH_HEADER_PREFETCH(p) __builtin_prefetch((p))
+#else
+#define RICH_HEADER_PREFETCH(p) ((void)(p))
+#endif
+#endif
+#ifndef RICH_HEADER_PREFETCH_DISTANCE
+#define RICH_HEADER_PREFETCH_DISTANCE 512
+#endif
+
+// Error codes returned by rich_header_from_data and friends, the positive
+// values are the size of the rich header. RICH_HEADER_OK is only used by
+// RICH_HEADER_RESULT.Status.
+enum {
+  RICH_HEADER_OK = 0,
+  RICH_HEADER_NOT_FOUND = -1,       // "Rich" signature not found
+  RICH_HEADER_DANS_NOT_FOUND = -2,  // masked "DanS" signature not found
+  RICH_HEADER_BUDGET_EXCEEDED = -3, // max_scan bytes scanned without a result
+  RICH_HEADER_NO_MEMORY = -4,       // the arena is too small (rich_header_decode)
+};
+
+// Status codes returned by rich_header_check_pe.
+enum {
+  RICH_HEADER_PE_OK = 0,
+  RICH_HEADER_PE_TRUNCATED,     // not enough data, see rich_header_window_size
+  RICH_HEADER_PE_BAD_MZ,        // missing "MZ" magic number
+  RICH_HEADER_PE_BAD_LFANEW,    // e_lfanew leaves no room for a rich header
+  RICH_HEADER_PE_BAD_SIGNATURE, // missing "PE\0\0" signature at e_lfanew
+  RICH_HEADER_PE_STATUS_COUNT,
+};
+
 typedef struct {
   uint16_t BuildNumber;
   uint16_t ProductID;
   uint32_t ObjectCount;
 } IMAGE_MASKED_RICH_HEADER_PRODUCT;
 
+// This macro packs the (ProductID, BuildNumber) pair of an unmasked product
+// into a single 32-bit value (aka "CompID", the first dword of the product as
+// it's stored in the file), which is handy as the key of counters or sketches.
+#define rich_header_product_comp_id(product) \
+    (((uint32_t)(product).ProductID << 16) | (uint32_t)(product).BuildNumber)
+
 // Head of the rich header wich is xor'ed with the IMAGE_RICH_HEADER.Key
 // therefore it's called "MASKED".
 typedef struct {
@@ -45,14 +114,104 @@ typedef struct {
   uint32_t Key;
 } IMAGE_RICH_HEADER;
 
+// Validation flags of RICH_HEADER_RESULT.
+#define RICH_HEADER_FLAG_PE        0x1 // rich_header_check_pe passed
+#define RICH_HEADER_FLAG_CHECKSUM  0x2 // the Key matches the computed checksum
+#define RICH_HEADER_FLAG_RECOVERED 0x4 // found by rich_header_recover
+
+// Options of rich_header_scan_ex.
+#define RICH_HEADER_SCAN_NO_FLAGS   0x1 // don't compute the validation flags
+#define RICH_HEADER_SCAN_NO_RECOVER 0x2 // don't fall back to rich_header_recover
+#define RICH_HEADER_SCAN_UNALIGNED  0x4 // data is not a whole file, look for "Rich"
+                                        // at every byte from the first one
+                                        // (implies NO_FLAGS and NO_RECOVER)
+
+// Options used by rich_header_scan and rich_header_scan_batch, e.g. define it
+// to RICH_HEADER_SCAN_NO_FLAGS before including the implementation to get a
+// scanner without the validation code for bulk processing.
+#ifndef RICH_HEADER_SCAN_OPTIONS
+#define RICH_HEADER_SCAN_OPTIONS 0
+#endif
+
+// Result of rich_header_scan, the offsets are relative to the beginning of the
+// data and are only valid if Status is RICH_HEADER_OK.
+typedef struct {
+  int32_t Status;       // RICH_HEADER_OK or one of the error codes
+  uint32_t Flags;       // RICH_HEADER_FLAG_*
+  uint32_t DansOffset;  // offset of the IMAGE_MASKED_RICH_HEADER
+  uint32_t RichOffset;  // offset of the IMAGE_RICH_HEADER
+  uint32_t ProductsLen; // number of products
+  uint32_t Key;
+} RICH_HEADER_RESULT;
+
+// Number of products stored inline in RICH_HEADER_DECODED, almost all rich
+// headers have fewer products than this.
+#ifndef RICH_HEADER_INLINE_PRODUCTS
+#define RICH_HEADER_INLINE_PRODUCTS 32
+#endif
+
+// Caller provided memory used by rich_header_decode for the (rare) headers
+// with more than RICH_HEADER_INLINE_PRODUCTS products. The allocations are
+// never freed one by one, reset Used to 0 to free all of them at once.
+//
+// Once Base is full the allocations are forwarded to Upstream (if it's not
+// NULL) which is never asked to free anything either, so it can be backed by
+// any per-request allocator (e.g. a std::pmr::monotonic_buffer_resource) and
+// released in one shot with it.
+typedef struct {
+  char *Base;
+  size_t Size;
+  size_t Used;
+  void *(*Upstream)(void *ctx, size_t size, size_t alignment);
+  void *UpstreamCtx;
+} RICH_HEADER_ARENA;
+
+// Decoded (unmasked) products of a rich header, use
+// rich_header_decoded_products to get them. The products live inline unless
+// they didn't fit, in which case Spill points into the arena. The structure can
+// be freely copied.
+typedef struct {
+  uint32_t ProductsLen;
+  IMAGE_MASKED_RICH_HEADER_PRODUCT *Spill;
+  IMAGE_MASKED_RICH_HEADER_PRODUCT InlineProducts[RICH_HEADER_INLINE_PRODUCTS];
+} RICH_HEADER_DECODED;
+
+#define rich_header_decoded_products(decoded) \
+    ((decoded)->Spill != NULL ? (decoded)->Spill : (decoded)->InlineProducts)
+
+// Read callback used by rich_header_read_window, it should read up to size
+// bytes into buf and return the number of bytes read. Returning 0 means end of
+// input (or error).
+typedef size_t (*rich_header_read_fn)(void *ctx, void *buf, size_t size);
+
 #ifdef __cplusplus
 extern "C" { // Stop changing my function names!
 #endif
 
 long rich_header_from_data(const void *data, size_t data_size, IMAGE_RICH_HEADER **rhdr);
-void rich_header_unmask(const IMAGE_RICH_HEADER *rhdr, size_t masked_rhdr_size, char masked_rhdr[masked_rhdr_size]);
+long rich_header_from_data_bounded(const void *data, size_t data_size, size_t max_scan, IMAGE_RICH_HEADER **rhdr);
+long rich_header_recover(const void *data, size_t data_size, IMAGE_RICH_HEADER **rhdr);
+int rich_header_scan(const void *data, size_t data_size, size_t max_scan, RICH_HEADER_RESULT *result);
+int rich_header_scan_ex(const void *data, size_t data_size, size_t max_scan, unsigned options, RICH_HEADER_RESULT *result);
+void rich_header_scan_batch(size_t n, const void *const data[], const size_t data_size[], size_t max_scan,
+                           RICH_HEADER_RESULT result[]);
+uint32_t rich_header_checksum(const void *data, const RICH_HEADER_RESULT *result);
+const char *rich_header_status_to_cstr(int status);
+int rich_header_decode(const void *data, const RICH_HEADER_RESULT *result, RICH_HEADER_DECODED *decoded,
+                       RICH_HEADER_ARENA *arena);
+int rich_header_decode_batch(size_t n, const void *const data[], const RICH_HEADER_RESULT result[],
+                             RICH_HEADER_DECODED decoded[], RICH_HEADER_ARENA *arena);
+void *rich_header_arena_alloc(RICH_HEADER_ARENA *arena, size_t size);
+uint64_t rich_header_fingerprint(const IMAGE_MASKED_RICH_HEADER_PRODUCT *products, size_t products_len);
+uint64_t rich_header_toolchain_fingerprint(const IMAGE_MASKED_RICH_HEADER_PRODUCT *products, size_t products_len);
+void rich_header_unmask(const IMAGE_RICH_HEADER *rhdr, size_t masked_rhdr_size,
+                        char masked_rhdr[RICH_HEADER_VLA(masked_rhdr_size)]);
 const char* rich_header_productid_to_cstr(uint16_t product_id);
 const char *rich_header_productid_to_vsver_cstr(uint16_t product_id);
+size_t rich_header_window_size(const void *data, size_t data_size);
+int rich_header_check_pe(const void *data, size_t data_size);
+const char *rich_header_pe_status_to_cstr(int status);
+int rich_header_read_window(rich_header_read_fn read, void *ctx, void *buf, size_t buf_size, size_t *data_size);
 
 #ifdef __cplusplus
 } // close extern C
@@ -62,6 +221,184 @@ const char *rich_header_productid_to_vsver_cstr(uint16_t product_id);
 
 #ifdef RICH_HEADER_IMPLEMENTATION
 
+// Tracing hooks called around each stage (read, scan, decode) with the name
+// of the stage, define them before including the implementation to record
+// e.g. Chrome trace events. They expand to nothing by default.
+#ifndef RICH_HEADER_TRACE_BEGIN
+#define RICH_HEADER_TRACE_BEGIN(name) ((void)0)
+#endif
+#ifndef RICH_HEADER_TRACE_END
+#define RICH_HEADER_TRACE_END(name) ((void)0)
+#endif
+
+// Define RICH_HEADER_CROSSCHECK to check every result of the batch scan
+// against the single buffer scan, RICH_HEADER_ASSERT is called with the
+// comparison so the first divergence stops the program. Both share the same
+// helpers, crosscheck.c tests them against an independent reference.
+#ifdef RICH_HEADER_CROSSCHECK
+#ifndef RICH_HEADER_ASSERT
+#include <assert.h>
+#define RICH_HEADER_ASSERT(x) assert(x)
+#endif
+#endif
+
+static uint32_t
+rich_header_rol32(uint32_t value, uint32_t shift)
+{
+  shift &= 31;
+  return shift ? (value << shift) | (value >> (32 - shift)) : value;
+}
+
+// Scan [p, limit) for the "Rich" signature every step bytes, returns NULL if
+// it's not found.
+//
+// The rich header is dword aligned relative to the beginning of the file so
+// we only have to look at every 4th byte (unless RICH_HEADER_SCAN_UNALIGNED is
+// used, for data that is not a whole file). The loads are done with memcpy
+// since the data itself does not have to be aligned. Before each 64 byte block
+// the data RICH_HEADER_PREFETCH_DISTANCE bytes ahead is prefetched so the
+// misses on cold data overlap instead of stalling one after the other.
+//
+// The step is meant to be a constant, so each caller gets a loop with a fixed
+// stride once this is inlined.
+static inline const char *
+rich_header_find_signature(const char *p, const char *limit, size_t step)
+{
+  static const char rich_header_signature[] = { 'R', 'i', 'c', 'h' };
+  uint32_t signature, dword;
+
+  memcpy(&signature, rich_header_signature, sizeof(signature));
+  while (p < limit) {
+    const char *block_limit = limit - p > 64 ? p + 64 : limit;
+    if (RICH_HEADER_PREFETCH_DISTANCE > 0 && limit - p > RICH_HEADER_PREFETCH_DISTANCE)
+      RICH_HEADER_PREFETCH(p + RICH_HEADER_PREFETCH_DISTANCE);
+
+    for (; p < block_limit; p += step) {
+      memcpy(&dword, p, sizeof(dword));
+      if (dword == signature) return p;
+    }
+  }
+  return NULL;
+}
+
+// Validate a "Rich" candidate and calculate the size of the header by walking
+// backward from it down to lower, for at most max_scan bytes.
+//
+// The walk goes one product (8 bytes) at a time since the products region is
+// always a multiple of 8, and stops at the masked head: the masked "DanS"
+// signature followed by the null padding which is equal to the Key once
+// masked. A "Rich" string which is not a rich header (e.g. in the DOS stub or
+// in a string table) doesn't have that head and is rejected.
+static long
+rich_header_find_dans(const char *lower, const char *rich, size_t max_scan)
+{
+  static const char rich_header_dans[] = { 'D', 'a', 'n', 'S' };
+  uint32_t dans, key, head[4];
+
+  memcpy(&dans, rich_header_dans, sizeof(dans));
+  memcpy(&key, rich + offsetof(IMAGE_RICH_HEADER, Key), sizeof(key));
+  for (size_t size = sizeof(head); size <= (size_t)(rich - lower); size += sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT)) {
+    if (size >= max_scan) return RICH_HEADER_BUDGET_EXCEEDED;
+    memcpy(head, rich - size, sizeof(head));
+    if ((head[0] ^ key) == dans && head[1] == key && head[2] == key && head[3] == key)
+      return (long)size;
+  }
+  return RICH_HEADER_DANS_NOT_FOUND;
+}
+
+// Last position where a whole IMAGE_RICH_HEADER (signature and key) still fits
+// in the data, for a scan which starts at start.
+static const char *
+rich_header_scan_limit(const char *start, const char *data, size_t data_size)
+{
+  if (data_size < (size_t)(start - data) + sizeof(IMAGE_RICH_HEADER)) return start;
+  return data + data_size - sizeof(IMAGE_RICH_HEADER) + 1;
+}
+
+// State of the scan of one buffer, shared by rich_header_from_data_bounded,
+// rich_header_scan and the lanes of rich_header_scan_batch.
+typedef struct {
+  const char *start; // beginning of the scan, the budget is counted from here
+  const char *limit; // see rich_header_scan_limit
+  const char *p;     // next position of the forward scan
+  const char *lower; // lower bound of the next backward walk
+  const char *rich;  // last "Rich" candidate
+  size_t max_scan;
+  size_t spent;      // bytes walked backward from the rejected candidates
+  long size;         // size of the header or RICH_HEADER_* status
+} RICH_HEADER_SCAN_STATE;
+
+// Distance between two positions of the forward scan for the given options, a
+// constant when the options are.
+#define rich_header_scan_step_size(options) ((options) & RICH_HEADER_SCAN_UNALIGNED ? 1 : sizeof(uint32_t))
+
+static void
+rich_header_scan_init(RICH_HEADER_SCAN_STATE *state, const char *data, size_t data_size, size_t max_scan,
+                      unsigned options)
+{
+  if (options & RICH_HEADER_SCAN_UNALIGNED) {
+    // not a whole file, there's no MS-DOS header to skip and no alignment.
+    state->start = data;
+  } else {
+    // Since there is no correct way to detect the size of the DOS stub we have
+    // to just skip it. The size of the IMAGE_DOS_HEADER is 64 bytes which means
+    // we are aligned correctly and we can just move on from here.
+    state->start = data + RICH_HEADER_DOS_HEADER_SIZE;
+  }
+  state->limit = rich_header_scan_limit(state->start, data, data_size);
+  state->p = state->start;
+  state->lower = state->start;
+  state->rich = NULL;
+  state->max_scan = max_scan;
+  state->spent = 0;
+  state->size = RICH_HEADER_NOT_FOUND;
+}
+
+// Scan at most chunk bytes forward for the "Rich" signature (every step bytes,
+// see rich_header_scan_step_size) and validate the candidate if there's one.
+// Returns false once the scan is over, state->size is the result then.
+//
+// The backward walk of a candidate stops at the previous rejected one: that
+// part of the data was already walked and holds no head the previous candidate
+// could have used, so every byte is walked at most once and the total work is
+// linear. The cost is that a header whose masked products contain the "Rich"
+// string itself (one chance in 2^32 per dword) is not found.
+static inline bool
+rich_header_scan_step(RICH_HEADER_SCAN_STATE *state, size_t step, size_t chunk)
+{
+  size_t budget = state->max_scan > state->spent ? state->max_scan - state->spent : 0;
+  const char *bounded_limit = (size_t)(state->limit - state->start) > budget ? state->start + budget : state->limit;
+
+  if (state->p >= bounded_limit) {
+    if (bounded_limit < state->limit) state->size = RICH_HEADER_BUDGET_EXCEEDED;
+    return false;
+  }
+
+  const char *chunk_limit = (size_t)(bounded_limit - state->p) > chunk ? state->p + chunk : bounded_limit;
+  const char *rich = rich_header_find_signature(state->p, chunk_limit, step);
+  if (rich == NULL) {
+    state->p = chunk_limit;
+    return true;
+  }
+
+  state->rich = rich;
+  state->size = rich_header_find_dans(state->lower, rich, budget - (rich - state->start));
+  if (state->size != RICH_HEADER_DANS_NOT_FOUND) return false;
+
+  state->spent += rich - state->lower;
+  state->lower = rich + step;
+  state->p = rich + step;
+  return true;
+}
+
+// Bytes touched by the scan so far, i.e. what it took out of max_scan.
+static size_t
+rich_header_scan_used(const RICH_HEADER_SCAN_STATE *state)
+{
+  const char *p = state->p < state->limit ? state->p : state->limit;
+  return (size_t)(p - state->start) + state->spent;
+}
+
 // Find the rich header based on the "Rich" signature and calculate the length
 // using the masked "DanS" signature.
 //
@@ -71,33 +408,424 @@ const char *rich_header_productid_to_vsver_cstr(uint16_t product_id);
 long
 rich_header_from_data(const void *data, size_t data_size, IMAGE_RICH_HEADER **rhdr)
 {
-  static const char rich_header_signature[] = { 'R', 'i', 'c', 'h' };
+  return rich_header_from_data_bounded(data, data_size, SIZE_MAX, rhdr);
+}
+
+// Same as rich_header_from_data but the scan (forward for the "Rich" signature
+// and backward for the "DanS" signature) touches at most max_scan bytes, which
+// puts a hard bound on the time spent on adversarial files.
+//
+// A "Rich" candidate which fails the validation (see rich_header_find_dans)
+// doesn't stop the scan, the forward scan resumes right after it and the next
+// candidate is only walked back down to it (see rich_header_scan_step), so no
+// byte is walked backward twice. If no candidate is valid -2 is returned and
+// *rhdr points to the last one.
+//
+// The function returns RICH_HEADER_BUDGET_EXCEEDED (-3) if the budget ran out
+// before the scan could finish.
+long
+rich_header_from_data_bounded(const void *data, size_t data_size, size_t max_scan, IMAGE_RICH_HEADER **rhdr)
+{
+  RICH_HEADER_SCAN_STATE state;
+
+  rich_header_scan_init(&state, (const char*)data, data_size, max_scan, 0);
+  while (rich_header_scan_step(&state, rich_header_scan_step_size(0), SIZE_MAX)) {
+  }
+
+  if (state.rich != NULL) *rhdr = (IMAGE_RICH_HEADER*)state.rich;
+  return state.size;
+}
+
+// Checksum of the MS-DOS header and stub up to the rich header (except
+// e_lfanew), seeded with its offset. This is the first part of
+// rich_header_checksum.
+static uint32_t
+rich_header_checksum_stub(const unsigned char *bytes, uint32_t dans_offset)
+{
+  uint32_t checksum = dans_offset;
+
+  for (uint32_t i = 0; i < dans_offset; ++i) {
+    if (i >= RICH_HEADER_LFANEW_OFFSET && i < RICH_HEADER_LFANEW_OFFSET + sizeof(uint32_t)) continue;
+    checksum += rich_header_rol32(bytes[i], i);
+  }
+  return checksum;
+}
+
+// Checksum of one masked product, rotated by its object count.
+static uint32_t
+rich_header_checksum_product(const char *product, uint32_t key)
+{
+  uint32_t comp_id, count;
+
+  memcpy(&comp_id, product, sizeof(comp_id));
+  memcpy(&count, product + sizeof(comp_id), sizeof(count));
+  return rich_header_rol32(comp_id ^ key, count ^ key);
+}
+
+// Find the end of the header whose masked head is at dans_offset: the first
+// product slot whose second dword is the Key (the damaged signature followed
+// by the Key) and where the checksum of the products before it is the Key too.
+// The checksum is updated one product at a time so each slot is read once, and
+// a product whose masked ObjectCount is the Key (i.e. 0) is not mistaken for
+// the end. The stub and the slots read count against max_scan.
+static long
+rich_header_recover_end(const char *bytes, size_t data_size, size_t dans_offset, uint32_t key, size_t max_scan,
+                        IMAGE_RICH_HEADER **rhdr)
+{
+  uint32_t checksum, dword;
+
+  if (dans_offset > max_scan) return RICH_HEADER_BUDGET_EXCEEDED;
+  max_scan -= dans_offset;
+  checksum = rich_header_checksum_stub((const unsigned char*)bytes, (uint32_t)dans_offset);
+
+  for (size_t end = dans_offset + offsetof(IMAGE_MASKED_RICH_HEADER, Products);
+       end <= data_size - sizeof(IMAGE_RICH_HEADER); end += sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT)) {
+    if (max_scan < sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT)) return RICH_HEADER_BUDGET_EXCEEDED;
+    max_scan -= sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT);
+    memcpy(&dword, bytes + end + offsetof(IMAGE_RICH_HEADER, Key), sizeof(dword));
+    if (dword == key && checksum == key) {
+      *rhdr = (IMAGE_RICH_HEADER*)(bytes + end);
+      return (long)(end - dans_offset);
+    }
+    checksum += rich_header_checksum_product(bytes + end, key);
+  }
+  return RICH_HEADER_NOT_FOUND;
+}
+
+static long rich_header_recover_bounded(const char *bytes, size_t data_size, size_t max_scan,
+                                       IMAGE_RICH_HEADER **rhdr);
+
+// Recover a rich header whose "Rich" signature was overwritten (e.g. by a
+// packer) but whose masked body is still intact.
+//
+// The masked header starts with the pattern X,K,K,K where X^K is "DanS" (the
+// null padding xor'ed with the Key is the Key itself). The pattern is found by
+// sliding a window of four adjacent dwords over the stub, each dword is loaded
+// once. Only the first match is considered: its end is searched forward from
+// there (see rich_header_recover_end) and the header is accepted only if the
+// Key matches the checksum, so the data is read in a single pass.
+//
+// The function returns the size of the rich header and *rhdr points to the
+// damaged IMAGE_RICH_HEADER (its Key is valid, so rich_header_unmask works),
+// returns -1 if the pattern is not found or the checksum doesn't match.
+long
+rich_header_recover(const void *data, size_t data_size, IMAGE_RICH_HEADER **rhdr)
+{
+  return rich_header_recover_bounded((const char*)data, data_size, SIZE_MAX, rhdr);
+}
+
+// Implementation of rich_header_recover which touches at most max_scan bytes
+// (counted from the end of the MS-DOS header, like the scan), returns
+// RICH_HEADER_BUDGET_EXCEEDED if that's not enough.
+static long
+rich_header_recover_bounded(const char *bytes, size_t data_size, size_t max_scan, IMAGE_RICH_HEADER **rhdr)
+{
   static const char rich_header_dans[] = { 'D', 'a', 'n', 'S' };
-  bool found_header = false;
-
-  // Since there is no correct way to detect the size of the DOS stub we have to
-  // just skip it. The size of the IMAGE_DOS_HEADER is 64 bytes which means we
-  // are aligned correctly and we can just move on from here.
-  uint32_t *p = (uint32_t*)((char*)data + 64);
-  while((char*)p + sizeof(rich_header_signature) < (char*)data + data_size) {
-    if (memcmp((void*)p, rich_header_signature, sizeof(rich_header_signature)) == 0) {
-      found_header = true;
-      *rhdr = (IMAGE_RICH_HEADER*)p;
-      break;
+  uint32_t dans, x, k1, k2, k3;
+
+  // the masked head (16 bytes) and the IMAGE_RICH_HEADER must fit in the data.
+  size_t head_size = sizeof(uint32_t) * 4;
+  if (data_size < RICH_HEADER_DOS_HEADER_SIZE + head_size + sizeof(IMAGE_RICH_HEADER))
+    return RICH_HEADER_NOT_FOUND;
+
+  memcpy(&dans, rich_header_dans, sizeof(dans));
+  memcpy(&x, bytes + RICH_HEADER_DOS_HEADER_SIZE, sizeof(x));
+  memcpy(&k1, bytes + RICH_HEADER_DOS_HEADER_SIZE + 4, sizeof(k1));
+  memcpy(&k2, bytes + RICH_HEADER_DOS_HEADER_SIZE + 8, sizeof(k2));
+
+  size_t last = data_size - head_size - sizeof(IMAGE_RICH_HEADER);
+  for (size_t offset = RICH_HEADER_DOS_HEADER_SIZE; offset <= last; offset += sizeof(uint32_t)) {
+    size_t used = offset - RICH_HEADER_DOS_HEADER_SIZE + head_size;
+    if (used > max_scan) return RICH_HEADER_BUDGET_EXCEEDED;
+    memcpy(&k3, bytes + offset + 12, sizeof(k3));
+
+    if (k1 == k2 && k2 == k3 && (x ^ k1) == dans)
+      return rich_header_recover_end(bytes, data_size, offset, k1, max_scan - used, rhdr);
+
+    x = k1;
+    k1 = k2;
+    k2 = k3;
+  }
+
+  return RICH_HEADER_NOT_FOUND;
+}
+
+// Fill the result of a scan from its final state, falling back to
+// rich_header_recover if no valid "Rich" signature was found: either there was
+// none at all, or every candidate was rejected (e.g. a stray "Rich" string next
+// to a header whose own signature was overwritten). If the recovery fails too
+// the status of the scan is kept, unless the budget ran out.
+static void
+rich_header_set_result(const char *data, size_t data_size, const RICH_HEADER_SCAN_STATE *state, unsigned options,
+                       RICH_HEADER_RESULT *result)
+{
+  IMAGE_RICH_HEADER *rhdr = (IMAGE_RICH_HEADER*)state->rich;
+  long size = state->size;
+
+  memset(result, 0, sizeof(*result));
+  if ((size == RICH_HEADER_NOT_FOUND || size == RICH_HEADER_DANS_NOT_FOUND) &&
+      !(options & (RICH_HEADER_SCAN_NO_RECOVER | RICH_HEADER_SCAN_UNALIGNED))) {
+    // the recovery pass only gets what's left of the budget of the scan.
+    IMAGE_RICH_HEADER *recovered = NULL;
+    size_t used = rich_header_scan_used(state);
+    long recovered_size = rich_header_recover_bounded(data, data_size,
+                                                      state->max_scan > used ? state->max_scan - used : 0, &recovered);
+    if (recovered_size > 0) {
+      rhdr = recovered;
+      size = recovered_size;
+      result->Flags |= RICH_HEADER_FLAG_RECOVERED;
+    } else if (recovered_size == RICH_HEADER_BUDGET_EXCEEDED) {
+      size = RICH_HEADER_BUDGET_EXCEEDED;
     }
-    p += 1;
   }
 
-  if (!found_header) return -1;
+  if (size <= 0) {
+    result->Status = (int32_t)size;
+    return;
+  }
+
+  result->Status = RICH_HEADER_OK;
+  result->RichOffset = (uint32_t)((const char*)rhdr - data);
+  result->DansOffset = result->RichOffset - (uint32_t)size;
+  result->ProductsLen = (uint32_t)rich_header_products_len(size);
+  memcpy(&result->Key, (const char*)rhdr + offsetof(IMAGE_RICH_HEADER, Key), sizeof(result->Key));
+
+  if (options & (RICH_HEADER_SCAN_NO_FLAGS | RICH_HEADER_SCAN_UNALIGNED)) return;
+  if (rich_header_check_pe(data, data_size) == RICH_HEADER_PE_OK)
+    result->Flags |= RICH_HEADER_FLAG_PE;
+  if (rich_header_checksum(data, result) == result->Key)
+    result->Flags |= RICH_HEADER_FLAG_CHECKSUM;
+}
+
+// Implementation of rich_header_scan and rich_header_scan_ex, the options are
+// meant to be a constant: once this is inlined the scan loop has a fixed stride
+// and only the branches the options need are left.
+static inline int
+rich_header_scan_options(const char *data, size_t data_size, size_t max_scan, unsigned options,
+                         RICH_HEADER_RESULT *result)
+{
+  RICH_HEADER_SCAN_STATE state;
+
+  if (data_size > UINT32_MAX) data_size = UINT32_MAX;
+
+  RICH_HEADER_TRACE_BEGIN("scan");
+  rich_header_scan_init(&state, data, data_size, max_scan, options);
+  while (rich_header_scan_step(&state, rich_header_scan_step_size(options), SIZE_MAX)) {
+  }
+  rich_header_set_result(data, data_size, &state, options, result);
+  RICH_HEADER_TRACE_END("scan");
+  return result->Status;
+}
+
+// Find the rich header just like rich_header_from_data_bounded and fill in
+// everything the caller needs to use it (offsets, products count, Key and
+// validation flags) so there's no need to calculate them from the pointers.
+//
+// If no valid "Rich" signature is found (none at all, or only rejected
+// candidates) the header is recovered with rich_header_recover (see
+// RICH_HEADER_FLAG_RECOVERED), within what's left of max_scan after the scan. Since the offsets are 32-bit only the first 4GiB of
+// the data are scanned.
+//
+// The scan uses the RICH_HEADER_SCAN_OPTIONS options, which are fixed at
+// compile time, see rich_header_scan_ex to choose them at runtime.
+//
+// The function returns result->Status.
+int
+rich_header_scan(const void *data, size_t data_size, size_t max_scan, RICH_HEADER_RESULT *result)
+{
+  return rich_header_scan_options((const char*)data, data_size, max_scan, RICH_HEADER_SCAN_OPTIONS, result);
+}
+
+// Same as rich_header_scan but with the given RICH_HEADER_SCAN_* options.
+int
+rich_header_scan_ex(const void *data, size_t data_size, size_t max_scan, unsigned options, RICH_HEADER_RESULT *result)
+{
+  return rich_header_scan_options((const char*)data, data_size, max_scan, options, result);
+}
+
+// Same as rich_header_scan but for n independent buffers at once, each of
+// them with its own max_scan budget, the results are written to result[i].
+//
+// Instead of scanning the buffers one after the other, the scan of
+// RICH_HEADER_BATCH_LANES buffers is interleaved one cache line at a time so
+// the memory accesses of independent buffers can overlap.
+void
+rich_header_scan_batch(size_t n, const void *const data[], const size_t data_size[], size_t max_scan,
+                       RICH_HEADER_RESULT result[])
+{
+  const size_t step = rich_header_scan_step_size(RICH_HEADER_SCAN_OPTIONS);
+
+  RICH_HEADER_TRACE_BEGIN("scan_batch");
+  for (size_t base = 0; base < n; base += RICH_HEADER_BATCH_LANES) {
+    RICH_HEADER_SCAN_STATE state[RICH_HEADER_BATCH_LANES];
+    size_t size_limit[RICH_HEADER_BATCH_LANES];
+    bool running[RICH_HEADER_BATCH_LANES];
+    size_t lanes = n - base < RICH_HEADER_BATCH_LANES ? n - base : RICH_HEADER_BATCH_LANES;
+    size_t active = lanes;
+
+    for (size_t l = 0; l < lanes; ++l) {
+      size_limit[l] = data_size[base + l] > UINT32_MAX ? UINT32_MAX : data_size[base + l];
+      rich_header_scan_init(&state[l], (const char*)data[base + l], size_limit[l], max_scan, RICH_HEADER_SCAN_OPTIONS);
+      running[l] = true;
+      if (state[l].p < state[l].limit) RICH_HEADER_PREFETCH(state[l].p);
+    }
+
+    while (active > 0) {
+      for (size_t l = 0; l < lanes; ++l) {
+        if (!running[l]) continue;
+        if (!rich_header_scan_step(&state[l], step, RICH_HEADER_BATCH_STRIDE)) {
+          running[l] = false;
+          active -= 1;
+        }
+      }
+    }
 
-  // calculate the size of the header based on the "DanS" masked signature.
-  for (uint32_t *p = (uint32_t *)*rhdr; (void*)p >= data; --p) {
-    if ((*p ^ (*rhdr)->Key) == *(uint32_t *)rich_header_dans) {
-      return (char *)*rhdr - (char *)p;
+    for (size_t l = 0; l < lanes; ++l) {
+      rich_header_set_result((const char*)data[base + l], size_limit[l], &state[l], RICH_HEADER_SCAN_OPTIONS,
+                             &result[base + l]);
+#ifdef RICH_HEADER_CROSSCHECK
+      RICH_HEADER_RESULT reference;
+      rich_header_scan(data[base + l], data_size[base + l], max_scan, &reference);
+      RICH_HEADER_ASSERT(memcmp(&reference, &result[base + l], sizeof(reference)) == 0);
+#endif
     }
   }
+  RICH_HEADER_TRACE_END("scan_batch");
+}
+
+// Calculate the rich header checksum (i.e. the Key) of a header found by
+// rich_header_scan.
+//
+// The checksum covers the MS-DOS header and stub (except e_lfanew) up to the
+// rich header and the products, each product being rotated by its object
+// count.
+uint32_t
+rich_header_checksum(const void *data, const RICH_HEADER_RESULT *result)
+{
+  uint32_t checksum = rich_header_checksum_stub((const unsigned char*)data, result->DansOffset);
+
+  const char *products = (const char*)data + result->DansOffset + offsetof(IMAGE_MASKED_RICH_HEADER, Products);
+  for (uint32_t i = 0; i < result->ProductsLen; ++i)
+    checksum += rich_header_checksum_product(products + i * sizeof(IMAGE_MASKED_RICH_HEADER_PRODUCT), result->Key);
+
+  return checksum;
+}
+
+const char *
+rich_header_status_to_cstr(int status)
+{
+  switch (status) {
+  case RICH_HEADER_OK: return "ok";
+  case RICH_HEADER_NOT_FOUND: return "rich header not found";
+  case RICH_HEADER_DANS_NOT_FOUND: return "masked DanS signature not found";
+  case RICH_HEADER_BUDGET_EXCEEDED: return "scan budget exceeded";
+  case RICH_HEADER_NO_MEMORY: return "out of arena memory";
+  default: return "";
+  }
+}
+
+// Calculate how many bytes from the beginning of the file are needed to find
+// the rich header, based on the e_lfanew field of the MS-DOS header.
+//
+// The rich header always sits between the MS-DOS header and the PE header so
+// there is no need to read the whole file: read the first
+// RICH_HEADER_DOS_HEADER_SIZE bytes, call this function and then read the rest
+// of the window (e.g. with your own asynchronous I/O) and pass it to
+// rich_header_from_data. The window also includes the "PE\0\0" signature so it
+// can be verified with rich_header_check_pe.
+//
+// The function returns 0 if data is too small to contain the MS-DOS header.
+size_t
+rich_header_window_size(const void *data, size_t data_size)
+{
+  uint32_t e_lfanew;
+
+  if (data_size < RICH_HEADER_DOS_HEADER_SIZE) return 0;
+
+  memcpy(&e_lfanew, (const char*)data + RICH_HEADER_LFANEW_OFFSET, sizeof(e_lfanew));
+  return (size_t)e_lfanew + sizeof(uint32_t);
+}
+
+// Cheap check to reject files that are not PE files before doing any scan.
+//
+// The function is meant to be called twice: first with only the MS-DOS header
+// (RICH_HEADER_DOS_HEADER_SIZE bytes) which already rejects most non-PE files,
+// and if it returns RICH_HEADER_PE_TRUNCATED, again after reading the whole
+// window (see rich_header_window_size) to verify the PE signature.
+int
+rich_header_check_pe(const void *data, size_t data_size)
+{
+  static const char pe_signature[] = { 'P', 'E', 0, 0 };
+  uint32_t e_lfanew;
+
+  if (data_size < RICH_HEADER_DOS_HEADER_SIZE) return RICH_HEADER_PE_TRUNCATED;
+  if (memcmp(data, "MZ", 2) != 0) return RICH_HEADER_PE_BAD_MZ;
+
+  memcpy(&e_lfanew, (const char*)data + RICH_HEADER_LFANEW_OFFSET, sizeof(e_lfanew));
+  if (e_lfanew < RICH_HEADER_DOS_HEADER_SIZE || e_lfanew > RICH_HEADER_MAX_LFANEW)
+    return RICH_HEADER_PE_BAD_LFANEW;
+
+  if (data_size < (size_t)e_lfanew + sizeof(pe_signature)) return RICH_HEADER_PE_TRUNCATED;
+  if (memcmp((const char*)data + e_lfanew, pe_signature, sizeof(pe_signature)) != 0)
+    return RICH_HEADER_PE_BAD_SIGNATURE;
+
+  return RICH_HEADER_PE_OK;
+}
+
+const char *
+rich_header_pe_status_to_cstr(int status)
+{
+  switch (status) {
+  case RICH_HEADER_PE_OK: return "ok";
+  case RICH_HEADER_PE_TRUNCATED: return "truncated";
+  case RICH_HEADER_PE_BAD_MZ: return "bad MZ magic";
+  case RICH_HEADER_PE_BAD_LFANEW: return "bad e_lfanew";
+  case RICH_HEADER_PE_BAD_SIGNATURE: return "bad PE signature";
+  default: return "";
+  }
+}
+
+// Read exactly size bytes unless the input ends, returns the bytes read.
+static size_t
+rich_header_read_full(rich_header_read_fn read, void *ctx, char *buf, size_t size)
+{
+  size_t n = 0;
+  while (n < size) {
+    size_t r = read(ctx, buf + n, size - n);
+    if (r == 0) break;
+    n += r;
+  }
+  return n;
+}
+
+// Pull the rich header window (see rich_header_window_size) from any source,
+// e.g. a pipe or a decompressor, and check it with rich_header_check_pe.
+//
+// The source is never read past the window so a decompressor can stop right
+// after the PE signature, and non-PE files are rejected after reading only the
+// MS-DOS header. *data_size is the number of bytes already in buf (0 at first)
+// and is updated with the bytes read.
+//
+// The function returns the rich_header_check_pe status. If it returns
+// RICH_HEADER_PE_TRUNCATED while the window is larger than buf_size, grow buf to
+// the window size and call it again with the same *data_size to continue.
+int
+rich_header_read_window(rich_header_read_fn read, void *ctx, void *buf, size_t buf_size, size_t *data_size)
+{
+  RICH_HEADER_TRACE_BEGIN("read");
+  if (*data_size < RICH_HEADER_DOS_HEADER_SIZE && buf_size >= RICH_HEADER_DOS_HEADER_SIZE)
+    *data_size += rich_header_read_full(read, ctx, (char*)buf + *data_size, RICH_HEADER_DOS_HEADER_SIZE - *data_size);
 
-  return -2;
+  int status = rich_header_check_pe(buf, *data_size);
+  if (status == RICH_HEADER_PE_TRUNCATED && *data_size >= RICH_HEADER_DOS_HEADER_SIZE) {
+    size_t window_size = rich_header_window_size(buf, *data_size);
+    if (window_size <= buf_size) {
+      *data_size += rich_header_read_full(read, ctx, (char*)buf + *data_size, window_size - *data_size);
+      status = rich_header_check_pe(buf, *data_size);
+    }
+  }
+  RICH_HEADER_TRACE_END("read");
+  return status;
 }
 
 // Decipher (xor) the masked rich header based on the IMAGE_RICH_HEADER pointer
@@ -112,12 +840,156 @@ rich_header_from_data(const void *data, size_t data_size, IMAGE_RICH_HEADER **rh
 // the masked rich header (see how `p` is defined bellow) so you could just use
 // same buffer as the file and just overwrite it with the unmasked header.
 void
-rich_header_unmask(const IMAGE_RICH_HEADER *rhdr, size_t masked_rhdr_size, char masked_rhdr[masked_rhdr_size])
+rich_header_unmask(const IMAGE_RICH_HEADER *rhdr, size_t masked_rhdr_size, char masked_rhdr[RICH_HEADER_VLA(masked_rhdr_size)])
 {
+  RICH_HEADER_TRACE_BEGIN("unmask");
   uint32_t *p = (uint32_t*)((char*)rhdr - masked_rhdr_size);
   for (size_t i = 0; i < masked_rhdr_size / sizeof(uint32_t); ++i) {
     ((uint32_t*)masked_rhdr)[i] = p[i] ^ rhdr->Key;
   }
+  RICH_HEADER_TRACE_END("unmask");
+}
+
+// Allocate size bytes (8 bytes aligned) from the arena, returns NULL if the
+// arena is full and there's no upstream allocator. Base itself doesn't have to
+// be aligned, the padding is computed from the actual address.
+void *
+rich_header_arena_alloc(RICH_HEADER_ARENA *arena, size_t size)
+{
+  if (arena->Used <= arena->Size) {
+    size_t padding = (size_t)(-((uintptr_t)arena->Base + arena->Used) & 7);
+    size_t left = arena->Size - arena->Used;
+    if (left >= padding && left - padding >= size) {
+      void *p = arena->Base + arena->Used + padding;
+      arena->Used += padding + size;
+      return p;
+    }
+  }
+
+  return arena->Upstream != NULL ? arena->Upstream(arena->UpstreamCtx, size, 8) : NULL;
+}
+
+// Decipher the products of a header found by rich_header_scan into decoded,
+// without touching the data (unlike rich_header_unmask).
+//
+// Nothing is allocated unless the header has more than
+// RICH_HEADER_INLINE_PRODUCTS products, those are stored in the arena (which
+// may be NULL if you don't care about them).
+//
+// The function returns RICH_HEADER_OK, or RICH_HEADER_NO_MEMORY if the
+// products didn't fit.
+int
+rich_header_decode(const void *data, const RICH_HEADER_RESULT *result, RICH_HEADER_DECODED *decoded,
+                   RICH_HEADER_ARENA *arena)
+{
+  IMAGE_MASKED_RICH_HEADER_PRODUCT *products = decoded->InlineProducts;
+
+  decoded->ProductsLen = 0;
+  decoded->Spill = NULL;
+  if (result->ProductsLen > RICH_HEADER_INLINE_PRODUCTS) {
+    products = arena != NULL ? (IMAGE_MASKED_RICH_HEADER_PRODUCT*)rich_header_arena_alloc(
+                                   arena, result->ProductsLen * sizeof(*products)) : NULL;
+    if (products == NULL) return RICH_HEADER_NO_MEMORY;
+    decoded->Spill = products;
+  }
+
+  RICH_HEADER_TRACE_BEGIN("decode");
+
+  const char *masked = (const char*)data + result->DansOffset + offsetof(IMAGE_MASKED_RICH_HEADER, Products);
+  for (uint32_t i = 0; i < result->ProductsLen * 2; ++i) {
+    uint32_t dword;
+    memcpy(&dword, masked + i * sizeof(dword), sizeof(dword));
+    dword ^= result->Key;
+    memcpy((char*)products + i * sizeof(dword), &dword, sizeof(dword));
+  }
+
+  decoded->ProductsLen = result->ProductsLen;
+  RICH_HEADER_TRACE_END("decode");
+  return RICH_HEADER_OK;
+}
+
+// Decode the results of rich_header_scan_batch, every spilled product list
+// comes from the arena so all the memory of the batch can be released at
+// once. Results whose Status is not RICH_HEADER_OK are decoded as empty.
+//
+// The function returns RICH_HEADER_OK, or RICH_HEADER_NO_MEMORY if the products
+// of any of the headers didn't fit (those are decoded as empty too).
+int
+rich_header_decode_batch(size_t n, const void *const data[], const RICH_HEADER_RESULT result[],
+                         RICH_HEADER_DECODED decoded[], RICH_HEADER_ARENA *arena)
+{
+  int status = RICH_HEADER_OK;
+
+  for (size_t i = 0; i < n; ++i) {
+    if (result[i].Status != RICH_HEADER_OK) {
+      decoded[i].ProductsLen = 0;
+      decoded[i].Spill = NULL;
+    } else if (rich_header_decode(data[i], &result[i], &decoded[i], arena) != RICH_HEADER_OK) {
+      status = RICH_HEADER_NO_MEMORY;
+    }
+  }
+
+  return status;
+}
+
+#define RICH_HEADER_FNV1A_OFFSET 0xcbf29ce484222325
+#define RICH_HEADER_FNV1A_PRIME 0x100000001b3
+
+static uint64_t
+rich_header_fnv1a(uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= RICH_HEADER_FNV1A_PRIME;
+  }
+  return hash;
+}
+
+// Final avalanche of the fingerprints (the MurmurHash3 finalizer). FNV-1a on
+// its own leaves the high bits poorly mixed for short inputs, after this every
+// bit of the fingerprint depends on every input bit.
+static uint64_t
+rich_header_fmix64(uint64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccd;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+// Hash (64-bit FNV-1a) of the unmasked products, e.g. the products of a
+// RICH_HEADER_DECODED or of a header deciphered by rich_header_unmask.
+//
+// The rest of the unmasked header ("DanS" and the null padding) is the same for
+// every header so identical headers have the same fingerprint, which makes it
+// a good key to deduplicate them. The bits of the fingerprint are uniformly
+// distributed so it can also be fed as is to cardinality sketches (e.g.
+// HyperLogLog, which uses some bits as the register index and counts the
+// leading zeros of the others) and to hash tables.
+uint64_t
+rich_header_fingerprint(const IMAGE_MASKED_RICH_HEADER_PRODUCT *products, size_t products_len)
+{
+  return rich_header_fmix64(rich_header_fnv1a(RICH_HEADER_FNV1A_OFFSET, products, products_len * sizeof(*products)));
+}
+
+// Same as rich_header_fingerprint but only the (ProductID, BuildNumber) pairs
+// are hashed, the object counts are left out.
+//
+// Headers of binaries built with the same toolchain usually only differ by
+// their object counts, so this identifies the shared product list (e.g. as the
+// key of a dictionary of product lists, storing only the counts per sample).
+uint64_t
+rich_header_toolchain_fingerprint(const IMAGE_MASKED_RICH_HEADER_PRODUCT *products, size_t products_len)
+{
+  uint64_t hash = RICH_HEADER_FNV1A_OFFSET;
+  for (size_t i = 0; i < products_len; ++i) {
+    hash = rich_header_fnv1a(hash, &products[i].BuildNumber, sizeof(products[i].BuildNumber));
+    hash = rich_header_fnv1a(hash, &products[i].ProductID, sizeof(products[i].ProductID));
+  }
+  return rich_header_fmix64(hash);
 }
 
 // Based on: